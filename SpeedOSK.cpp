@@ -19,170 +19,320 @@
 #include <iostream>
 #include <fstream>
 #include <cstdlib>
+#include <ctime>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include "SpeedOSK.h"
-#include "SpeedOSKBoard.h"
 
 SpeedOSK::SpeedOSK() {
+	this->stick = NULL;
+	this->evdev = NULL;
+	this->board = NULL;
+	this->input_thread = NULL;
+	SDL_AtomicSet(&this->input_quit, 0);
+	this->input_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (this->input_wakeup < 0) {
+		SDL_LogCritical(SDL_LOG_CATEGORY_ERROR, "Failed to create input wakeup: %s\n", strerror(errno));
+		exit(1);
+	}
+	this->input_lock = SDL_CreateMutex();
+	if (!this->input_lock) {
+		SDL_LogCritical(SDL_LOG_CATEGORY_ERROR, "Failed to create input lock: %s\n", SDL_GetError());
+		exit(1);
+	}
+	this->height_zone = 1;
+	this->width_zone = 1;
+	this->current_board_level = 0;
+	this->left_trigger_down = false;
+	this->right_trigger_down = false;
+	this->lastzone = 4;
+	this->lwv = 1;
+	this->lhv = 1;
+	this->last_hat_button_down = -1;
 	this->LoadSettings();
+	if (this->input_evdev) {
+		// open the controller before SDL and the window are up
+		this->evdev = new SpeedOSKEvdev(this->evdev_device);
+		if (!this->evdev->IsOpen()) {
+			SDL_LogCritical(SDL_LOG_CATEGORY_ERROR, "No Joystick found, exiting");
+			exit(1); // we can not work without one
+		}
+	}
 	this->InitSDL();
-	this->SetupJoystick();
+	if (!this->evdev)
+		this->SetupJoystick();
 }
 
 SpeedOSK::~SpeedOSK() {
+	delete this->evdev;
+	SDL_DestroyMutex(this->input_lock);
+	close(this->input_wakeup);
 	SDL_Quit();
 }
 
+/*
+ * The main thread owns the window: it pumps SDL events and presents the
+ * board. Input handling and key injection run on the input thread, so a
+ * present blocking on vsync or the compositor does not hold them up.
+ */
 int SpeedOSK::Run() {
 	SpeedOSKBoard osk;
-	SDL_bool done = SDL_FALSE;
+	this->board = &osk;
+	this->input_thread = SDL_CreateThread(SpeedOSK::InputThread, "SpeedOSKInput", this);
+	if (!this->input_thread) {
+		SDL_LogCritical(SDL_LOG_CATEGORY_ERROR, "Failed to create input thread: %s\n", SDL_GetError());
+		exit(1);
+	}
+	// SDL joystick events are pumped here as well, see input= in LoadSettings
 	SDL_Event event;
-	int ZONE_1 = 32767/2;
-	int height_zone = 1; // 0 = top, 1 = middle, 2 = bottom
-	int width_zone = 1; // 0 = left, 1 = moddle, 2 = right
-	int current_board_level = 0;
-	bool left_trigger_down = false;
-	bool right_trigger_down = false;
-	int lastzone = 4;
-	int lwv = 1;
-	int lhv = 1;
-	int button_map[4] = {2, 1, 3, 0};
-	Uint8 last_hat_button_down = -1;
-	while(!done) {
-		while(SDL_WaitEvent(&event)){
-			switch(event.type) {
-			case SDL_QUIT:
-				done = SDL_TRUE;
-				break;
-			case SDL_JOYBUTTONDOWN:
-			case SDL_JOYBUTTONUP:
-				// L1= b4, R1 = b5
-				// L4 = b3, L5 = b9, R4 = b1, R5 = b10
-				if (event.jbutton.button >= 0 && event.jbutton.button < 4) {
-					osk.ButtonChanged(button_map[event.jbutton.button], event.jbutton.state == 1);
-					SDL_LogDebug(SDL_LOG_CATEGORY_INPUT, "JBUTTON: button: %d which-j: %d button-state: %d\n", event.jbutton.button, event.jbutton.which, event.jbutton.state);
-				} else if (event.jbutton.button == 10 && event.jbutton.state == 1) {
-					return 0;
-				} else if (event.jbutton.button == 9 && event.jbutton.state == 1) {
-					osk.ToggleVisibility();
+	bool done = false;
+	while(!done && SDL_WaitEvent(&event)) {
+		if (event.type == osk.RedrawEvent()) {
+			osk.Present(false);
+			continue;
+		}
+		switch(event.type) {
+		case SDL_QUIT:
+			done = true;
+			break;
+		case SDL_WINDOWEVENT:
+			if (event.window.event == SDL_WINDOWEVENT_EXPOSED || event.window.event == SDL_WINDOWEVENT_SHOWN)
+				osk.Present(true);
+			break;
+		case SDL_JOYBUTTONDOWN:
+		case SDL_JOYBUTTONUP:
+			SDL_LogDebug(SDL_LOG_CATEGORY_INPUT, "JBUTTON: button: %d which-j: %d button-state: %d\n", event.jbutton.button, event.jbutton.which, event.jbutton.state);
+			this->QueueAction({INPUT_BUTTON, event.jbutton.button, event.jbutton.state, event.jbutton.timestamp * 1000LL});
+			break;
+		case SDL_JOYAXISMOTION:
+			this->QueueAction({INPUT_AXIS, event.jaxis.axis, event.jaxis.value, event.jaxis.timestamp * 1000LL});
+			break;
+		case SDL_JOYHATMOTION:
+			this->QueueAction({INPUT_HAT, event.jhat.hat, event.jhat.value, event.jhat.timestamp * 1000LL});
+			break;
+			case SDL_JOYDEVICEREMOVED:
+				if (this->stick && event.jdevice.which == SDL_JoystickInstanceID(this->stick)) {
+					SDL_JoystickClose(this->stick);
+					this->stick = NULL;
 				}
 				break;
-			case SDL_JOYAXISMOTION:
-				// axis 2 left trigger, axis 5 right trigger
-				//printf("J %d, A %d, V %d\n", event.jaxis.which, event.jaxis.axis, event.jaxis.value);
-				if (event.jaxis.axis == 1 || event.jaxis.axis == 4) {
-					if (abs(event.jaxis.value) < ZONE_1) { // middle based on height
-						height_zone = 1;
-					} else if (event.jaxis.value < 0) {
-						height_zone = 0;
-					} else {
-						height_zone = 2;
-					}
-					lhv = event.jaxis.value;
-				} else if(event.jaxis.axis == 0 || event.jaxis.axis == 3) {
-					if (abs(event.jaxis.value) < ZONE_1) {
-						width_zone = 1;
-					} else if (event.jaxis.value < 0) {
-						width_zone = 0;
-					} else {
-						width_zone = 2;
-					}
-					lwv = event.jaxis.value;
-				} else if(event.jaxis.axis == 2) {
-					if (event.jaxis.value > 10000 && !left_trigger_down) {
-						left_trigger_down = true;
-						if(this->level_mode_steps) {
-							if(current_board_level <= 1)
-								++current_board_level;
-							osk.ChangeLevel(current_board_level);
-						}else {
-							osk.ChangeLevel(1);
-						}
-					} else if (event.jaxis.value <= 10000 && left_trigger_down){
-						left_trigger_down = false;
-						if (!this->level_mode_steps)
-							osk.ChangeLevel(0);
-					}
-				} else if(event.jaxis.axis == 5) {
-					if (event.jaxis.value > 10000 && !right_trigger_down) {
-						right_trigger_down = true;
-						if (this->level_mode_steps) {
-							if (current_board_level >= 1)
-								--current_board_level;
-							osk.ChangeLevel(current_board_level);
-						} else {
-							osk.ChangeLevel(2);
-						}
-					} else if (event.jaxis.value <= 10000 && right_trigger_down) {
-						right_trigger_down = false;
-						if(!this->level_mode_steps)
-							osk.ChangeLevel(0);
-					}
-				}
-				if (height_zone * 3 + width_zone != lastzone) {
-					lastzone = height_zone * 3 + width_zone;
-					SDL_LogDebug(SDL_LOG_CATEGORY_INPUT, "JAXIS: h-zone: %d w-zone: %d and last-h-zone: %d last-w-zone: %d\n" , height_zone, width_zone, lhv, lwv);
-					osk.ChangeZone(lastzone);
+			case SDL_JOYDEVICEADDED:
+				if (!this->stick) {
+					this->stick = SDL_JoystickOpen(event.jdevice.which);
 				}
 				break;
-			case SDL_JOYHATMOTION:
-				/*
-				*a  bit indicates a specific direction being down for the hat
-				* there can be multiple down at the same time
-				* for our purpose we only accept exactly one
-				* 0     0     0     0
-				* left  down  right up
-				*/
-				SDL_LogDebug(SDL_LOG_CATEGORY_INPUT, "JHAT: value: %d", event.jhat.value);
-				switch(event.jhat.value) {
-				case 0:
-					if (last_hat_button_down == -1)
-						break;
-					osk.ButtonChanged((int)last_hat_button_down, false);
-					last_hat_button_down = -1;
-					break;
-				case 1:
-					osk.ButtonChanged(0, true);
-					last_hat_button_down = 0;
-					break;
-				case 2:
-					osk.ButtonChanged(1, true);
-					last_hat_button_down = 1;
-					break;
-				case 4:
-					osk.ButtonChanged(2, true);
-					last_hat_button_down = 2;
-					break;
-				case 8:
-					osk.ButtonChanged(3, true);
-					last_hat_button_down = 3;
-					break;
-				default:
-					break;
-				}
+			default:
 				break;
-				case SDL_JOYDEVICEREMOVED:
-					if (this->stick && event.jdevice.which == SDL_JoystickInstanceID(this->stick)) {
-						SDL_JoystickClose(this->stick);
-						this->stick = NULL;
-					}
-					break;
-				case SDL_JOYDEVICEADDED:
-					if (!this->stick) {
-						this->stick = SDL_JoystickOpen(event.jdevice.which);
-					}
-					break;
-				default:
-					break;
+		}
+	}
+	SDL_AtomicSet(&this->input_quit, 1);
+	this->Wakeup();
+	SDL_WaitThread(this->input_thread, NULL);
+	this->board = NULL;
+	return 0;
+}
+
+int SpeedOSK::InputThread(void *data) {
+	static_cast<SpeedOSK*>(data)->InputLoop();
+	return 0;
+}
+
+void SpeedOSK::InputLoop() {
+	std::vector<inputAction> actions;
+	struct timespec now;
+	uint64_t wakeups;
+	bool ended = false;
+	if (this->evdev)
+		this->evdev->Watch(this->input_wakeup);
+	this->board->Draw();
+	while(!ended && !SDL_AtomicGet(&this->input_quit)) {
+		actions.clear();
+		// wake up for key repeats and modifier release as well, -1 waits for input only
+		int timeout = this->board->Timeout();
+		if (this->evdev) {
+			ended = !this->evdev->Wait(timeout, actions); // recorded stream is over
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			long long now_us = (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+			for (const inputAction &action : actions) {
+				if (action.type == INPUT_BUTTON)
+					SDL_LogDebug(SDL_LOG_CATEGORY_INPUT, "EVBUTTON: button: %d button-state: %d latency: %lldus\n", action.index, action.value, now_us - action.timestamp);
 			}
+		} else {
+			struct pollfd wakeup = {this->input_wakeup, POLLIN, 0};
+			poll(&wakeup, 1, timeout);
+		}
+		if (read(this->input_wakeup, &wakeups, sizeof(wakeups)) > 0) {
+			SDL_LockMutex(this->input_lock);
+			actions.insert(actions.end(), this->input_queue.begin(), this->input_queue.end());
+			this->input_queue.clear();
+			SDL_UnlockMutex(this->input_lock);
+		}
+		for (const inputAction &action : actions) {
+			switch(action.type) {
+			case INPUT_BUTTON:
+				this->JoyButton(action.index, action.value == 1);
+				break;
+			case INPUT_AXIS:
+				this->JoyAxis(action.index, action.value);
+				break;
+			case INPUT_HAT:
+				this->JoyHat(action.value);
+				break;
+			}
+		}
+		this->board->Tick();
+		this->board->Draw();
+	}
+	if (ended)
+		this->Quit();
+}
+
+/*
+ * Hand an SDL joystick event from the main thread to the input thread.
+ */
+void SpeedOSK::QueueAction(const inputAction &action) {
+	SDL_LockMutex(this->input_lock);
+	this->input_queue.push_back(action);
+	SDL_UnlockMutex(this->input_lock);
+	this->Wakeup();
+}
 
-			osk.Draw();
+void SpeedOSK::Wakeup() {
+	uint64_t one = 1;
+	if (write(this->input_wakeup, &one, sizeof(one)) < 0)
+		SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Failed to wake up input thread: %s\n", strerror(errno));
+}
+
+/*
+ * Ask the main thread to shut down, it stops the input thread afterwards.
+ */
+void SpeedOSK::Quit() {
+	SDL_Event event;
+	SDL_memset(&event, 0, sizeof(event));
+	event.type = SDL_QUIT;
+	SDL_PushEvent(&event);
+}
+
+void SpeedOSK::JoyButton(int button, bool down) {
+	SpeedOSKBoard &osk = *this->board;
+	int button_map[4] = {2, 1, 3, 0};
+	// L1= b4, R1 = b5
+	// L4 = b3, L5 = b9, R4 = b1, R5 = b10
+	if (button >= 0 && button < 4) {
+		osk.ButtonChanged(button_map[button], down);
+	} else if (button == 10 && down) {
+		this->Quit();
+	} else if (button == 9 && down) {
+		osk.ToggleVisibility();
+	}
+}
+
+void SpeedOSK::JoyAxis(int axis, int value) {
+	SpeedOSKBoard &osk = *this->board;
+	int ZONE_1 = 32767/2;
+	// axis 2 left trigger, axis 5 right trigger
+	//printf("A %d, V %d\n", axis, value);
+	if (axis == 1 || axis == 4) {
+		if (abs(value) < ZONE_1) { // middle based on height
+			this->height_zone = 1;
+		} else if (value < 0) {
+			this->height_zone = 0;
+		} else {
+			this->height_zone = 2;
+		}
+		this->lhv = value;
+	} else if(axis == 0 || axis == 3) {
+		if (abs(value) < ZONE_1) {
+			this->width_zone = 1;
+		} else if (value < 0) {
+			this->width_zone = 0;
+		} else {
+			this->width_zone = 2;
+		}
+		this->lwv = value;
+	} else if(axis == 2) {
+		if (value > 10000 && !this->left_trigger_down) {
+			this->left_trigger_down = true;
+			if(this->level_mode_steps) {
+				if(this->current_board_level <= 1)
+					++this->current_board_level;
+				osk.ChangeLevel(this->current_board_level);
+			}else {
+				osk.ChangeLevel(1);
+			}
+		} else if (value <= 10000 && this->left_trigger_down){
+			this->left_trigger_down = false;
+			if (!this->level_mode_steps)
+				osk.ChangeLevel(0);
+		}
+	} else if(axis == 5) {
+		if (value > 10000 && !this->right_trigger_down) {
+			this->right_trigger_down = true;
+			if (this->level_mode_steps) {
+				if (this->current_board_level >= 1)
+					--this->current_board_level;
+				osk.ChangeLevel(this->current_board_level);
+			} else {
+				osk.ChangeLevel(2);
+			}
+		} else if (value <= 10000 && this->right_trigger_down) {
+			this->right_trigger_down = false;
+			if(!this->level_mode_steps)
+				osk.ChangeLevel(0);
 		}
 	}
-	return 0;
+	if (this->height_zone * 3 + this->width_zone != this->lastzone) {
+		this->lastzone = this->height_zone * 3 + this->width_zone;
+		SDL_LogDebug(SDL_LOG_CATEGORY_INPUT, "JAXIS: h-zone: %d w-zone: %d and last-h-zone: %d last-w-zone: %d\n" , this->height_zone, this->width_zone, this->lhv, this->lwv);
+		osk.ChangeZone(this->lastzone);
+	}
+}
+
+void SpeedOSK::JoyHat(int value) {
+	SpeedOSKBoard &osk = *this->board;
+	/*
+	*a  bit indicates a specific direction being down for the hat
+	* there can be multiple down at the same time
+	* for our purpose we only accept exactly one
+	* 0     0     0     0
+	* left  down  right up
+	*/
+	SDL_LogDebug(SDL_LOG_CATEGORY_INPUT, "JHAT: value: %d", value);
+	switch(value) {
+	case 0:
+		if (this->last_hat_button_down == (Uint8)-1)
+			break;
+		osk.ButtonChanged((int)this->last_hat_button_down, false);
+		this->last_hat_button_down = -1;
+		break;
+	case 1:
+		osk.ButtonChanged(0, true);
+		this->last_hat_button_down = 0;
+		break;
+	case 2:
+		osk.ButtonChanged(1, true);
+		this->last_hat_button_down = 1;
+		break;
+	case 4:
+		osk.ButtonChanged(2, true);
+		this->last_hat_button_down = 2;
+		break;
+	case 8:
+		osk.ButtonChanged(3, true);
+		this->last_hat_button_down = 3;
+		break;
+	default:
+		break;
+	}
 }
 
 void SpeedOSK::InitSDL() {
-	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_JOYSTICK | SDL_INIT_GAMECONTROLLER) < 0)
+	// with evdev input SDL's joystick layer and its polling thread are not needed
+	Uint32 flags = SDL_INIT_VIDEO;
+	if (!this->input_evdev)
+		flags |= SDL_INIT_JOYSTICK | SDL_INIT_GAMECONTROLLER;
+	if (SDL_Init(flags) < 0)
 	{
 		SDL_LogCritical(SDL_LOG_CATEGORY_ERROR, "Couldn't initialize SDL: %s\n", SDL_GetError());
 		exit(1);
@@ -201,6 +351,8 @@ void SpeedOSK::SetupJoystick() {
 
 void SpeedOSK::LoadSettings() {
 	this->level_mode_steps = false;
+	this->input_evdev = false;
+	this->evdev_device = "";
 	const char* home = std::getenv("HOME");
 	if (home == NULL) {
 		return;
@@ -222,6 +374,18 @@ void SpeedOSK::LoadSettings() {
 					if (value == "steps") {
 						this->level_mode_steps = true;
 					}
+				} else if (name == "input") {
+					// "evdev" reads /dev/input directly instead of going through SDL.
+					// The default SDL input is pumped by the main thread, the same one
+					// that presents the board, so while a present blocks (e.g. on a busy
+					// compositor) controller events wait for it. evdev input is read on
+					// the input thread and is not held up by presents.
+					if (value == "evdev") {
+						this->input_evdev = true;
+					}
+				} else if (name == "evdev_device") {
+					// device or recorded evdev stream to use instead of the first controller found
+					this->evdev_device = value;
 				}
 			} else {
 				SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Config file is faulty");
@@ -18,7 +18,11 @@
 
 #ifndef SPEEDOSK_H_
 #define SPEEDOSK_H_
+#include <string>
+#include <vector>
 #include <SDL2/SDL.h>
+#include "SpeedOSKBoard.h"
+#include "SpeedOSKEvdev.h"
 
 class SpeedOSK {
 public:
@@ -27,11 +31,37 @@ public:
 	int Run();
 private:
 	SDL_Joystick *stick;
+	SpeedOSKEvdev *evdev; // NULL when input goes through SDL
 	bool level_mode_steps;
+	bool input_evdev;
+	std::string evdev_device;
+	SpeedOSKBoard *board; // only touched by the input thread while it runs
+	SDL_Thread *input_thread;
+	SDL_atomic_t input_quit;
+	int input_wakeup; // eventfd, signalled when input_queue got actions or on quit
+	SDL_mutex *input_lock;
+	std::vector<inputAction> input_queue; // SDL joystick events for the input thread
+	int height_zone; // 0 = top, 1 = middle, 2 = bottom
+	int width_zone; // 0 = left, 1 = moddle, 2 = right
+	int current_board_level;
+	bool left_trigger_down;
+	bool right_trigger_down;
+	int lastzone;
+	int lwv;
+	int lhv;
+	Uint8 last_hat_button_down;
 	void InitSDL();
 	void SetupJoystick();
 	void HandleEvents();
 	void LoadSettings();
+	static int InputThread(void *data);
+	void InputLoop();
+	void QueueAction(const inputAction &action);
+	void Wakeup();
+	void Quit();
+	void JoyButton(int button, bool down);
+	void JoyAxis(int axis, int value);
+	void JoyHat(int value);
 };
 
 #endif /* SPEEDOSK_H_ */
@@ -20,20 +20,32 @@
 #include <string>
 #include "SpeedOSKBoard.h"
 #include <X11/Intrinsic.h>
+#include <X11/XKBlib.h>
 #include <X11/extensions/XTest.h>
+#include <X11/extensions/XInput2.h>
 #include "Config.h"
 
 SpeedOSKBoard::SpeedOSKBoard() {
 	this->currentlevel = 0;
 	this->currentzone = 4;
-	this->zonechanged = true;
 	this->lastbuttonpressed = 5;
 	this->button_is_down = false;
+	this->pressedKey = NULL;
+	this->level_changed_while_down = false;
 	this->windowVisible = true;
 	this->display = NULL;
+	this->xtestKeyboard = -1;
+	this->renderer = NULL;
+	this->windowShown = true;
+	this->snapshotBack = 0;
+	this->snapshotFront = 1;
+	SDL_AtomicSet(&this->snapshotMiddle, 2);
+	this->lastPublished = {-1, -1, -1, false};
+	for (int i = 0; i < 3; i++) {
+		this->snapshots[i] = {this->currentlevel, this->currentzone, this->lastbuttonpressed, this->windowVisible};
+	}
 	this->LoadCharmap();
 
-	int rendererFlags = SDL_RENDERER_ACCELERATED;
 	SDL_DisplayMode mode;
 	SDL_GetDesktopDisplayMode(0, &mode);
 	this->window = SDL_CreateWindow("SpeedProgOSK", mode.w-OSK_WIDTH, mode.h-OSK_HEIGHT, OSK_WIDTH, OSK_HEIGHT, SDL_WINDOW_BORDERLESS);
@@ -54,7 +66,7 @@ SpeedOSKBoard::SpeedOSKBoard() {
 	}
 
 	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
-	this->renderer = SDL_CreateRenderer(this->window, -1, rendererFlags);
+	this->renderer = SDL_CreateRenderer(this->window, -1, SDL_RENDERER_ACCELERATED);
 	if (!this->renderer)
 	{
 		SDL_LogCritical(SDL_LOG_CATEGORY_ERROR, "Failed to create renderer: %s\n", SDL_GetError());
@@ -72,13 +84,26 @@ SpeedOSKBoard::SpeedOSKBoard() {
 		SDL_LogCritical(SDL_LOG_CATEGORY_ERROR, "Failed to open Xorg Display for sending keyboard events");
 		exit(1);
 	}
+	this->modifiers.Init(this, this->keyCodeShift, this->keyCodeAlt, this->keyCodeCtrl);
+	this->DisableAutoRepeat();
 
+	this->redrawEvent = SDL_RegisterEvents(1);
+	if (this->redrawEvent == (Uint32)-1) {
+		SDL_LogCritical(SDL_LOG_CATEGORY_ERROR, "Failed to register redraw event: %s\n", SDL_GetError());
+		exit(1);
+	}
+	this->Present(true);
 }
 
 SpeedOSKBoard::~SpeedOSKBoard() {
 	if(this->button_is_down){
 		this->ButtonChanged(this->lastbuttonpressed, false);
 	}
+	if (this->display) {
+		this->modifiers.ReleaseAll();
+		this->RestoreAutoRepeat();
+		XFlush(this->display);
+	}
 	if (this->renderer)
 		SDL_DestroyRenderer(this->renderer);
 	if (this->window)
@@ -90,32 +115,77 @@ SpeedOSKBoard::~SpeedOSKBoard() {
 		XCloseDisplay(this->display);
 }
 
-int SpeedOSKBoard::Draw() {
-	if (!this->zonechanged)
-		return 0;
-	int ret;
+/*
+ * Publish the current board state to the main thread,
+ * never blocks on the renderer.
+ */
+void SpeedOSKBoard::Draw() {
+	boardSnapshot snapshot = {this->currentlevel, this->currentzone, this->lastbuttonpressed, this->windowVisible};
+	if (snapshot.level == this->lastPublished.level && snapshot.zone == this->lastPublished.zone
+			&& snapshot.pressed == this->lastPublished.pressed && snapshot.visible == this->lastPublished.visible)
+		return;
+	this->lastPublished = snapshot;
+	this->snapshots[this->snapshotBack] = snapshot;
+	this->snapshotBack = SDL_AtomicSet(&this->snapshotMiddle, this->snapshotBack | SNAPSHOT_FRESH) & ~SNAPSHOT_FRESH;
+	SDL_Event event;
+	SDL_memset(&event, 0, sizeof(event));
+	event.type = this->redrawEvent;
+	SDL_PushEvent(&event);
+}
+
+Uint32 SpeedOSKBoard::RedrawEvent() {
+	return this->redrawEvent;
+}
+
+/*
+ * Draw the newest published snapshot, main thread only.
+ * force redraws the last one even if nothing new was published,
+ * for when the window got exposed or shown.
+ */
+void SpeedOSKBoard::Present(bool force) {
+	// several publishes can queue redraw events for the same snapshot
+	if (SDL_AtomicGet(&this->snapshotMiddle) & SNAPSHOT_FRESH) {
+		this->snapshotFront = SDL_AtomicSet(&this->snapshotMiddle, this->snapshotFront) & ~SNAPSHOT_FRESH;
+	} else if (!force) {
+		return;
+	}
+	const boardSnapshot &snapshot = this->snapshots[this->snapshotFront];
+	if (snapshot.visible != this->windowShown) {
+		this->windowShown = snapshot.visible;
+		if (snapshot.visible) {
+			SDL_ShowWindow(this->window);
+			SDL_SetWindowAlwaysOnTop(this->window, SDL_TRUE);
+		} else {
+			SDL_SetWindowAlwaysOnTop(this->window, SDL_FALSE);
+			SDL_HideWindow(this->window);
+		}
+	}
+	if (snapshot.visible)
+		this->Render(snapshot);
+}
+
+void SpeedOSKBoard::Render(const boardSnapshot &snapshot) {
 	SDL_SetRenderDrawColor(this->renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
 	SDL_RenderClear(this->renderer);
 	SDL_SetRenderDrawColor(this->renderer, 0, 255, 0, SDL_ALPHA_OPAQUE);
-	ret = SDL_RenderDrawLine(this->renderer, 0, 0, OSK_WIDTH, 0);
-	ret = SDL_RenderDrawLine(this->renderer, 0, 0, 0, OSK_HEIGHT-1);
-	ret = SDL_RenderDrawLine(this->renderer, 0, OSK_HEIGHT-1, OSK_WIDTH-1, OSK_HEIGHT-1);
-	ret = SDL_RenderDrawLine(this->renderer, OSK_WIDTH-1, OSK_HEIGHT-1, OSK_WIDTH-1, 0);
+	SDL_RenderDrawLine(this->renderer, 0, 0, OSK_WIDTH, 0);
+	SDL_RenderDrawLine(this->renderer, 0, 0, 0, OSK_HEIGHT-1);
+	SDL_RenderDrawLine(this->renderer, 0, OSK_HEIGHT-1, OSK_WIDTH-1, OSK_HEIGHT-1);
+	SDL_RenderDrawLine(this->renderer, OSK_WIDTH-1, OSK_HEIGHT-1, OSK_WIDTH-1, 0);
 
-	ret = SDL_RenderDrawLine(this->renderer, OSK_WIDTH/3, OSK_HEIGHT, OSK_WIDTH/3, 0);
-	ret = SDL_RenderDrawLine(this->renderer, OSK_WIDTH*2/3, OSK_HEIGHT, OSK_WIDTH*2/3, 0);
-	ret = SDL_RenderDrawLine(this->renderer, 0, OSK_HEIGHT/3, OSK_WIDTH-1, OSK_HEIGHT/3);
-	ret = SDL_RenderDrawLine(this->renderer, 0, OSK_HEIGHT*2/3, OSK_WIDTH-1, OSK_HEIGHT*2/3);
+	SDL_RenderDrawLine(this->renderer, OSK_WIDTH/3, OSK_HEIGHT, OSK_WIDTH/3, 0);
+	SDL_RenderDrawLine(this->renderer, OSK_WIDTH*2/3, OSK_HEIGHT, OSK_WIDTH*2/3, 0);
+	SDL_RenderDrawLine(this->renderer, 0, OSK_HEIGHT/3, OSK_WIDTH-1, OSK_HEIGHT/3);
+	SDL_RenderDrawLine(this->renderer, 0, OSK_HEIGHT*2/3, OSK_WIDTH-1, OSK_HEIGHT*2/3);
 	for(int q=0; q<9; q++) {
 		for(int i=0; i<4; i++) {
-			this->DrawChar(this->key_table_exp[this->currentlevel][q][i].label.c_str(), q, i);
+			this->DrawChar(snapshot, this->key_table_exp[snapshot.level][q][i].label.c_str(), q, i);
 		}
 	}
 	SDL_RenderPresent(this->renderer);
-	return ret;
 }
 
-void SpeedOSKBoard::DrawChar(const char *c, short quadrant, short inner) {
+void SpeedOSKBoard::DrawChar(const boardSnapshot &snapshot, const char *c, short quadrant, short inner) {
 	short qy =  quadrant/3;
 	short qx = quadrant%3;
 	short ix = 0, iy = 0;
@@ -142,8 +212,8 @@ void SpeedOSKBoard::DrawChar(const char *c, short quadrant, short inner) {
 	}
 
 	SDL_Color font_color_use;
-	if (quadrant == this->currentzone)
-		if (inner == lastbuttonpressed)
+	if (quadrant == snapshot.zone)
+		if (inner == snapshot.pressed)
 			font_color_use = font_color_pressed;
 		else
 			font_color_use = font_color_quadrant;
@@ -201,6 +271,13 @@ void SpeedOSKBoard::LoadCharmap() {
 	 * keycodes > 6000 < 7000 => ctrl+shift
 	 * keycodes > 8000 < 9000 => ctrl+alt
 	 * keycodes > 9000 < 10000 => ctrl+alt+shift
+	 * keycodes > 10000 < 10008 => sticky modifier key, the rest is a mask of
+	 *                              1 = shift, 2 = alt, 4 = ctrl
+	 *                              pressing it latches, pressing again locks,
+	 *                              pressing a third time releases
+	 * a keycode can be followed by a repeat policy for holding the key:
+	 * "accel" => repeat and speed up, "repeat" => repeat at a fixed rate,
+	 * nothing => do not repeat
 	 */
 	int level = 0;
 	int quadrant = 0;
@@ -231,7 +308,8 @@ void SpeedOSKBoard::LoadCharmap() {
 			if(first) {
 				this->key_table_exp[level][quadrant][inner].label = line;
 			} else {
-				this->key_table_exp[level][quadrant][inner].keyCode = std::stoi(line);
+				DecodeKeyCode(this->key_table_exp[level][quadrant][inner], std::stoi(line));
+				this->key_table_exp[level][quadrant][inner].repeat = SpeedOSKRepeat::ParsePolicy(line);
 			}
 			first = !first;
 			if (first) { // count up after each pair
@@ -254,11 +332,17 @@ void SpeedOSKBoard::LoadCharmap() {
 			for(int i=inner; i < 4; i++) {
 				this->key_table_exp[level][quadrant][i].label = "sp";
 				this->key_table_exp[level][quadrant][i].keyCode = 65;
+				this->key_table_exp[level][quadrant][i].modifiers = MOD_NONE;
+				this->key_table_exp[level][quadrant][i].sticky = false;
+				this->key_table_exp[level][quadrant][i].repeat = REPEAT_NONE;
 			}
 			for(int q=quadrant+1; q < 9; q++) {
 				for(int i=0; i < 4; i++) {
 					this->key_table_exp[level][q][i].label = "sp";
 					this->key_table_exp[level][q][i].keyCode = 65;
+					this->key_table_exp[level][q][i].modifiers = MOD_NONE;
+					this->key_table_exp[level][q][i].sticky = false;
+					this->key_table_exp[level][q][i].repeat = REPEAT_NONE;
 				}
 			}
 			for(int l=level+1; l < 3; l++) {
@@ -266,6 +350,9 @@ void SpeedOSKBoard::LoadCharmap() {
 					for(int i=0; i < 4; i++) {
 						this->key_table_exp[l][q][i].label = "sp";
 						this->key_table_exp[l][q][i].keyCode = 65;
+						this->key_table_exp[l][q][i].modifiers = MOD_NONE;
+						this->key_table_exp[l][q][i].sticky = false;
+						this->key_table_exp[l][q][i].repeat = REPEAT_NONE;
 					}
 				}
 			}
@@ -274,8 +361,26 @@ void SpeedOSKBoard::LoadCharmap() {
 
 }
 
+void SpeedOSKBoard::DecodeKeyCode(keyInfo &key, int code) {
+	// modifiers per thousand of the keycode, -1 marks ranges without meaning
+	static const int modifier_ranges[10] = {
+			MOD_NONE, MOD_SHIFT, -1, MOD_ALT, MOD_ALT | MOD_SHIFT,
+			MOD_CTRL, MOD_CTRL | MOD_SHIFT, -1, MOD_CTRL | MOD_ALT, MOD_ALL
+	};
+	key.keyCode = code;
+	key.modifiers = MOD_NONE;
+	key.sticky = false;
+	if (code > 10000 && code <= 10000 + MOD_ALL) {
+		key.modifiers = code - 10000;
+		key.sticky = true;
+	} else if (code > 1000 && code < 10000 && code % 1000 != 0 && modifier_ranges[code / 1000] >= 0) {
+		key.keyCode = code % 1000;
+		key.modifiers = modifier_ranges[code / 1000];
+	}
+}
+
 void SpeedOSKBoard::ChangeZone(int zone) {
-	if (this->currentzone != zone) {
+	if (this->currentzone != zone && this->button_is_down) {
 		this->ButtonChanged(this->lastbuttonpressed, false);
 	}
 	this->currentzone = zone;
@@ -285,89 +390,177 @@ void SpeedOSKBoard::ChangeZone(int zone) {
 
 void SpeedOSKBoard::ButtonChanged(int button, bool down) {
 	if ((!this->windowVisible && down) || button < 0 || button > 3) return;
+	// nothing was pressed that this could release
+	if (!down && (!this->button_is_down || button != this->lastbuttonpressed)) return;
+	// a second button while one is down, let go of the first one
+	if (down && this->button_is_down)
+		this->ButtonChanged(this->lastbuttonpressed, false);
 	this->lastbuttonpressed = button;
 	this->button_is_down = down;
-	int baseCode = this->key_table_exp[this->currentlevel][this->currentzone][button].keyCode;
-	KeyCode code = baseCode;
-	bool modifier_shift = false;
-	bool modifier_alt = false;
-	bool modifier_ctrl = false;
-	/*
-	 * keycodes > 1000 < 2000 => shift
-	 * keycodes > 3000 < 4000 => alt
-	 * keycodes > 5000 < 6000 => ctrl
-	 * keycodes > 4000 < 5000 => alt+shift
-	 * keycodes > 6000 < 7000 => ctrl+shift
-	 * keycodes > 8000 < 9000 => ctrl+alt
-	 * keycodes > 9000 < 10000 => ctrl+alt+shift
-	 */
-	if (baseCode > 1000 && baseCode < 2000) {
-		code = baseCode - 1000;
-		modifier_shift = true;
-	} else if (baseCode > 3000 && baseCode < 4000) {
-		code = baseCode - 3000;
-		modifier_alt = true;
-	} else if (baseCode > 5000 && baseCode < 6000) {
-		code = baseCode - 5000;
-		modifier_ctrl = true;
-	} else if (baseCode > 4000 && baseCode < 5000) {
-		code = baseCode - 4000;
-		modifier_alt = true;
-		modifier_shift = true;
-	} else if (baseCode > 6000 && baseCode < 7000) {
-		code = baseCode - 6000;
-		modifier_ctrl = true;
-		modifier_shift = true;
-	} else if (baseCode > 8000 && baseCode < 9000) {
-		code = baseCode - 8000;
-		modifier_ctrl = true;
-		modifier_alt = true;
-	} else if (baseCode > 9000 && baseCode < 10000) {
-		code = baseCode - 9000;
-		modifier_ctrl = true;
-		modifier_shift = true;
-		modifier_alt = true;
+	// release what went down, the level can have changed since
+	if (down)
+		this->pressedKey = &this->key_table_exp[this->currentlevel][this->currentzone][button];
+	const keyInfo &key = *this->pressedKey;
+	if (key.sticky) {
+		if (down) {
+			this->modifiers.Sticky(key.modifiers);
+			XFlush(this->display);
+			SDL_LogDebug(SDL_LOG_CATEGORY_INPUT, "Sticky %s latched: %d locked: %d\n", key.label.c_str(), this->modifiers.Latched(), this->modifiers.Locked());
+		}
+		return;
 	}
 	if (down) {
-		if (modifier_ctrl) {
-			XTestFakeKeyEvent(this->display, this->keyCodeCtrl, down, 0);
-		}
-		if (modifier_alt) {
-			XTestFakeKeyEvent(this->display, this->keyCodeAlt, down, 0);
-		}
-		if (modifier_shift) {
-			XTestFakeKeyEvent(this->display, this->keyCodeShift, down, 0);
-		}
+		this->modifiers.Apply(key.modifiers);
+		this->SendKey(key.keyCode, down);
+		this->repeat.Press(key.keyCode, key.repeat, SDL_GetTicks());
+		this->level_changed_while_down = false;
 	} else {
-		if (modifier_shift) {
-			XTestFakeKeyEvent(this->display, this->keyCodeShift, down, 0);
-		}
-		if (modifier_alt) {
-			XTestFakeKeyEvent(this->display, this->keyCodeAlt, down, 0);
-		}
-		if (modifier_ctrl) {
-			XTestFakeKeyEvent(this->display, this->keyCodeCtrl, down, 0);
+		this->repeat.Release();
+		this->SendKey(key.keyCode, down);
+		this->modifiers.KeyReleased(SDL_GetTicks());
+		// ChangeLevel could not drop the modifiers while the key was down
+		if (this->level_changed_while_down) {
+			this->modifiers.Idle();
+			this->level_changed_while_down = false;
 		}
 	}
-	XTestFakeKeyEvent(this->display, code, down, 0);
 	XFlush(this->display);
-	std::cout << "Send " << this->key_table_exp[this->currentlevel][this->currentzone][button].label << " as " << code << " state " << (down ? "down" : "up");
+	std::cout << "Send " << key.label << " as " << key.keyCode << " state " << (down ? "down" : "up");
 }
 
 void SpeedOSKBoard::ChangeLevel(int level) {
 	if(level < 0 || level > 2 || this->currentlevel == level) return;
 	this->currentlevel = level;
-	this->zonechanged = true;
+	// modifiers held for the keys of the old level are not needed anymore
+	if (!this->button_is_down) {
+		this->modifiers.Idle();
+		XFlush(this->display);
+	} else {
+		this->level_changed_while_down = true;
+	}
 }
 
+/*
+ * The window itself is shown or hidden by the main thread
+ * once it presents the snapshot carrying the new visibility.
+ */
 void SpeedOSKBoard::ToggleVisibility() {
 	if (this->windowVisible) {
-		SDL_SetWindowAlwaysOnTop(this->window, SDL_FALSE);
-		SDL_HideWindow(this->window);
-	} else {
-		SDL_ShowWindow(this->window);
-		SDL_SetWindowAlwaysOnTop(this->window, SDL_TRUE);
+		this->repeat.Release();
+		this->modifiers.ReleaseAll();
+		XFlush(this->display);
 	}
 	this->windowVisible = !this->windowVisible;
 }
 
+/*
+ * ms until the next key repeat or modifier release is due, -1 if none
+ */
+int SpeedOSKBoard::Timeout() {
+	Uint32 now = SDL_GetTicks();
+	int repeat_timeout = this->repeat.Timeout(now);
+	int modifier_timeout = this->modifiers.Timeout(now);
+	if (repeat_timeout < 0)
+		return modifier_timeout;
+	if (modifier_timeout < 0 || repeat_timeout < modifier_timeout)
+		return repeat_timeout;
+	return modifier_timeout;
+}
+
+/*
+ * Send all repeats that are due and drop idle modifiers with a single flush.
+ * A repeat is a release and press of the key.
+ */
+void SpeedOSKBoard::Tick() {
+	Uint32 now = SDL_GetTicks();
+	int count = this->repeat.Due(now);
+	for (int i = 0; i < count; i++) {
+		this->SendKey(this->repeat.KeyCode(), false);
+		this->SendKey(this->repeat.KeyCode(), true);
+	}
+	bool released = this->modifiers.Tick(now);
+	if (count == 0 && !released)
+		return;
+	XFlush(this->display);
+	if (count > 0)
+		SDL_LogDebug(SDL_LOG_CATEGORY_INPUT, "Repeated %d %d times\n", this->repeat.KeyCode(), count);
+}
+
+/*
+ * Callers flush once they sent everything that belongs together.
+ */
+void SpeedOSKBoard::SendKey(int keyCode, bool down) {
+	XTestFakeKeyEvent(this->display, keyCode, down, 0);
+}
+
+/*
+ * Repeating is up to SpeedOSKRepeat, so X must not repeat the keys we send
+ * on its own schedule. Only the XTEST keyboard our fake events come from is
+ * changed, per-key repeat is turned off there for every keycode in the keymap
+ * that has it on. Real keyboards keep repeating as the user set them up.
+ * RestoreAutoRepeat turns those keys back on.
+ */
+void SpeedOSKBoard::DisableAutoRepeat() {
+	int opcode, event, error, major = XkbMajorVersion, minor = XkbMinorVersion;
+	if (!XkbQueryExtension(this->display, &opcode, &event, &error, &major, &minor)
+			|| !XQueryExtension(this->display, "XInputExtension", &opcode, &event, &error)) {
+		SDL_LogError(SDL_LOG_CATEGORY_ERROR, "X has no XKB or XInput, held keys may get repeated by X as well\n");
+		return;
+	}
+	major = 2;
+	minor = 0;
+	if (XIQueryVersion(this->display, &major, &minor) != Success) {
+		SDL_LogError(SDL_LOG_CATEGORY_ERROR, "X has no XInput 2, held keys may get repeated by X as well\n");
+		return;
+	}
+	int count = 0;
+	XIDeviceInfo *devices = XIQueryDevice(this->display, XIAllDevices, &count);
+	for (int i = 0; i < count; i++) {
+		if (devices[i].use == XISlaveKeyboard && std::string(devices[i].name) == "Virtual core XTEST keyboard")
+			this->xtestKeyboard = devices[i].deviceid;
+	}
+	XIFreeDeviceInfo(devices);
+	if (this->xtestKeyboard < 0) {
+		SDL_LogError(SDL_LOG_CATEGORY_ERROR, "No XTEST keyboard found, held keys may get repeated by X as well\n");
+		return;
+	}
+	XkbDescPtr xkb = XkbAllocKeyboard();
+	xkb->device_spec = this->xtestKeyboard;
+	if (XkbGetControls(this->display, XkbPerKeyRepeatMask, xkb) != Success) {
+		SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Failed to get the XTEST keyboard controls, held keys may get repeated by X as well\n");
+		XkbFreeKeyboard(xkb, 0, True);
+		return;
+	}
+	for (int l = 0; l < 3; l++) {
+		for (int q = 0; q < 9; q++) {
+			for (int i = 0; i < 4; i++) {
+				const keyInfo &key = this->key_table_exp[l][q][i];
+				if (key.sticky || key.keyCode < 8 || key.keyCode > 255)
+					continue;
+				unsigned char &bits = xkb->ctrls->per_key_repeat[key.keyCode / 8];
+				if (!(bits & (1 << (key.keyCode % 8))))
+					continue; // off already or seen before
+				bits &= ~(1 << (key.keyCode % 8));
+				this->autoRepeatDisabled.push_back(key.keyCode);
+			}
+		}
+	}
+	if (!this->autoRepeatDisabled.empty())
+		XkbSetControls(this->display, XkbPerKeyRepeatMask, xkb);
+	XkbFreeKeyboard(xkb, 0, True);
+	XFlush(this->display);
+}
+
+void SpeedOSKBoard::RestoreAutoRepeat() {
+	if (this->autoRepeatDisabled.empty())
+		return;
+	XkbDescPtr xkb = XkbAllocKeyboard();
+	xkb->device_spec = this->xtestKeyboard;
+	if (XkbGetControls(this->display, XkbPerKeyRepeatMask, xkb) == Success) {
+		for (int keyCode : this->autoRepeatDisabled)
+			xkb->ctrls->per_key_repeat[keyCode / 8] |= 1 << (keyCode % 8);
+		XkbSetControls(this->display, XkbPerKeyRepeatMask, xkb);
+	}
+	XkbFreeKeyboard(xkb, 0, True);
+	this->autoRepeatDisabled.clear();
+}
@@ -19,30 +19,72 @@
 #ifndef SPEEDOSKBOARD_H_
 #define SPEEDOSKBOARD_H_
 #include <string>
+#include <vector>
 #include <X11/Xlib.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
+#include "SpeedOSKModifiers.h"
+#include "SpeedOSKRepeat.h"
 #define OSK_WIDTH 300
 #define OSK_HEIGHT 300
 
 struct keyInfo {
 	int keyCode;
+	int modifiers; // MOD_* the key needs, resolved from the keymap code
+	bool sticky; // key latches/locks its modifiers instead of sending keyCode
+	int repeat; // REPEAT_* policy while the key is held
 	std::string label;
 };
-class SpeedOSKBoard {
+
+/*
+ * Everything the main thread needs to know about the board
+ * to draw one frame, the key table itself does not change after loading.
+ */
+struct boardSnapshot {
+	int level;
+	int zone;
+	int pressed;
+	bool visible;
+};
+
+/*
+ * The window and renderer belong to the main thread, which pumps SDL events
+ * and calls Present. Everything else (input, key injection and Draw, which
+ * publishes the state) is only called from the input thread.
+ */
+class SpeedOSKBoard : public SpeedOSKKeySender {
 public:
 	SpeedOSKBoard();
 	virtual ~SpeedOSKBoard();
-	int Draw();
+	void Draw();
+	void Present(bool force);
+	Uint32 RedrawEvent();
 	void ChangeZone(int zone);
 	void ButtonChanged(int button, bool down);
 	void ChangeLevel(int level);
 	void ToggleVisibility();
+	int Timeout();
+	void Tick();
+	void SendKey(int keyCode, bool down) override;
 private:
 	static const constexpr SDL_Color font_color_default = {255, 0, 255};
 	static const constexpr SDL_Color font_color_quadrant = {0, 255, 0};
 	static const constexpr SDL_Color font_color_pressed = {0, 0, 255};
 	SDL_Renderer *renderer;
+	Uint32 redrawEvent; // pushed to the main thread when a snapshot was published
+	bool windowShown; // what the main thread last did to the window
+	/*
+	 * triple buffer between input and main thread
+	 * the input thread owns snapshotBack, the main thread snapshotFront
+	 * snapshotMiddle is swapped atomically and has SNAPSHOT_FRESH set
+	 * when it holds a snapshot that was not drawn yet
+	 */
+	static const constexpr int SNAPSHOT_FRESH = 4;
+	boardSnapshot snapshots[3];
+	int snapshotBack;
+	int snapshotFront;
+	SDL_atomic_t snapshotMiddle;
+	boardSnapshot lastPublished;
 	SDL_Window *window;
 	TTF_Font *font;
 	char key_table[1][37] = {
@@ -51,16 +93,25 @@ private:
 	keyInfo key_table_exp[3][9][4];
 	int currentlevel;
 	int currentzone;
-	bool zonechanged;
 	int lastbuttonpressed;
 	bool button_is_down;
+	const keyInfo *pressedKey; // key sent for the button that is down
+	bool level_changed_while_down;
 	Display *display;
 	int keyCodeShift;
 	int keyCodeAlt;
 	int keyCodeCtrl;
 	bool windowVisible;
-	void DrawChar(const char *c, short quadrant, short inner);
+	SpeedOSKModifiers modifiers;
+	SpeedOSKRepeat repeat;
+	int xtestKeyboard; // XInput id of the device XTest events come from, -1 if unknown
+	std::vector<int> autoRepeatDisabled; // keycodes we turned its autorepeat off for
+	void Render(const boardSnapshot &snapshot);
+	void DrawChar(const boardSnapshot &snapshot, const char *c, short quadrant, short inner);
 	void LoadCharmap();
+	void DisableAutoRepeat();
+	void RestoreAutoRepeat();
+	static void DecodeKeyCode(keyInfo &key, int code);
 };
 
 #endif /* SPEEDOSKBOARD_H_ */
@@ -0,0 +1,465 @@
+/*
+ *   SpeedOSK is a vitrual keyboard intended to be used with a controller
+ *   Copyright (C) 2022 Constantin Wenger
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <SDL2/SDL.h>
+#include "SpeedOSKEvdev.h"
+
+#define BITS_PER_LONG (sizeof(long) * 8)
+#define NBITS(x) ((((x) - 1) / BITS_PER_LONG) + 1)
+#define TEST_BIT(bit, array) ((array[(bit) / BITS_PER_LONG] >> ((bit) % BITS_PER_LONG)) & 1)
+
+SpeedOSKEvdev::SpeedOSKEvdev(const std::string &device) {
+	this->device = device;
+	this->fd = -1;
+	this->isStream = false;
+	this->polled = false;
+	this->dropped = false;
+	this->hatX = 0;
+	this->hatY = 0;
+	this->hatValue = 0;
+	this->pendingPos = 0;
+	this->replayStart = -1;
+	this->replayBase = 0;
+	this->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (this->epollFd < 0) {
+		SDL_LogCritical(SDL_LOG_CATEGORY_ERROR, "Failed to create epoll instance: %s\n", strerror(errno));
+		exit(1);
+	}
+	this->Scan();
+}
+
+SpeedOSKEvdev::~SpeedOSKEvdev() {
+	this->Close();
+	close(this->epollFd);
+}
+
+bool SpeedOSKEvdev::IsOpen() {
+	return this->fd >= 0;
+}
+
+/*
+ * Also return from Wait when fd becomes readable, reading it is up to the caller.
+ */
+void SpeedOSKEvdev::Watch(int fd) {
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if (epoll_ctl(this->epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+		SDL_LogError(SDL_LOG_CATEGORY_INPUT, "Failed to watch wakeup fd: %s\n", strerror(errno));
+}
+
+/*
+ * Wait up to timeout ms for controller input and append the resulting actions.
+ * Returns false once a recorded stream has been fully replayed.
+ */
+bool SpeedOSKEvdev::Wait(int timeout, std::vector<inputAction> &actions) {
+	struct epoll_event event;
+	if (this->fd < 0) {
+		// no controller, look for one again every second like a hotplug would
+		if (timeout < 0 || timeout > 1000)
+			timeout = 1000;
+		epoll_wait(this->epollFd, &event, 1, timeout);
+		this->Scan();
+		return true;
+	}
+	if (this->isStream)
+		return this->Replay(timeout, actions);
+	// regular files can not be added to epoll, they are always readable
+	if (this->polled && epoll_wait(this->epollFd, &event, 1, timeout) <= 0)
+		return true; // timeout or interrupted by a signal
+	// a watched fd woke us up, the controller may have nothing to read
+
+	struct input_event events[64];
+	for (;;) {
+		ssize_t len = read(this->fd, events, sizeof(events));
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			if (errno == ENODEV) {
+				SDL_LogInfo(SDL_LOG_CATEGORY_INPUT, "Controller removed\n");
+			} else {
+				SDL_LogError(SDL_LOG_CATEGORY_INPUT, "Failed to read controller events: %s\n", strerror(errno));
+			}
+			this->Release(actions);
+			this->Close();
+			break;
+		}
+		for (size_t i = 0; i < len / sizeof(struct input_event); i++) {
+			this->Translate(events[i], actions);
+		}
+	}
+	return true;
+}
+
+/*
+ * Hand out recorded events at the pace they were recorded at, counted from
+ * the first event of the replay. Their timestamps are moved to replay time.
+ */
+bool SpeedOSKEvdev::Replay(int timeout, std::vector<inputAction> &actions) {
+	struct epoll_event event;
+	if (this->pendingPos == this->pending.size()) {
+		this->WatchStream(true);
+		// regular files can not be added to epoll, they are always readable
+		if (this->polled && epoll_wait(this->epollFd, &event, 1, timeout) <= 0)
+			return true; // timeout or interrupted by a signal
+		struct input_event events[64];
+		ssize_t len = read(this->fd, events, sizeof(events));
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return true;
+			SDL_LogError(SDL_LOG_CATEGORY_INPUT, "Failed to read recorded events: %s\n", strerror(errno));
+		}
+		if (len <= 0) { // end of the recording
+			this->Release(actions);
+			this->Close();
+			return false;
+		}
+		this->pending.assign(events, events + len / sizeof(struct input_event));
+		this->pendingPos = 0;
+		if (this->pending.empty())
+			return true;
+		// do not wake up for more data before these are handed out
+		this->WatchStream(false);
+	}
+	long long now = Now();
+	if (this->replayStart < 0) {
+		this->replayStart = now;
+		this->replayBase = EventTime(this->pending[this->pendingPos]);
+	}
+	long long due = this->replayStart + EventTime(this->pending[this->pendingPos]) - this->replayBase;
+	if (due > now) {
+		int wait = (due - now + 999) / 1000;
+		if (timeout >= 0 && timeout < wait)
+			wait = timeout;
+		// sleep in epoll so a watched fd can still wake us up
+		epoll_wait(this->epollFd, &event, 1, wait);
+		now = Now();
+	}
+	while (this->pendingPos < this->pending.size()) {
+		struct input_event ev = this->pending[this->pendingPos];
+		due = this->replayStart + EventTime(ev) - this->replayBase;
+		if (due > now)
+			break;
+		ev.input_event_sec = due / 1000000;
+		ev.input_event_usec = due % 1000000;
+		this->Translate(ev, actions);
+		this->pendingPos++;
+	}
+	return true;
+}
+
+/*
+ * Turn waking up for a readable stream on or off,
+ * a fifo stays readable while recorded events wait for their time.
+ */
+void SpeedOSKEvdev::WatchStream(bool readable) {
+	if (!this->polled)
+		return;
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = readable ? (uint32_t)EPOLLIN : 0;
+	event.data.fd = this->fd;
+	epoll_ctl(this->epollFd, EPOLL_CTL_MOD, this->fd, &event);
+}
+
+long long SpeedOSKEvdev::Now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+long long SpeedOSKEvdev::EventTime(const struct input_event &ev) {
+	return (long long)ev.input_event_sec * 1000000 + ev.input_event_usec;
+}
+
+bool SpeedOSKEvdev::Open(const std::string &path) {
+	this->fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (this->fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(this->fd, &st) < 0) {
+		this->Close();
+		return false;
+	}
+	this->isStream = !S_ISCHR(st.st_mode);
+	if (this->isStream) {
+		this->MapStream();
+	} else {
+		unsigned long evbit[NBITS(EV_MAX)] = {0};
+		unsigned long keybit[NBITS(KEY_MAX)] = {0};
+		unsigned long absbit[NBITS(ABS_MAX)] = {0};
+		if (ioctl(this->fd, EVIOCGBIT(0, sizeof(evbit)), evbit) < 0
+				|| ioctl(this->fd, EVIOCGBIT(EV_KEY, sizeof(keybit)), keybit) < 0
+				|| ioctl(this->fd, EVIOCGBIT(EV_ABS, sizeof(absbit)), absbit) < 0
+				|| !TEST_BIT(EV_KEY, evbit) || !TEST_BIT(EV_ABS, evbit) || !TEST_BIT(ABS_X, absbit)
+				|| !(TEST_BIT(BTN_GAMEPAD, keybit) || TEST_BIT(BTN_JOYSTICK, keybit))) {
+			this->Close();
+			return false;
+		}
+		// monotonic timestamps, wall clock jumps would break latency numbers
+		int clock = CLOCK_MONOTONIC;
+		ioctl(this->fd, EVIOCSCLOCKID, &clock);
+		this->MapDevice();
+	}
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = this->fd;
+	// fails with EPERM for regular files, those are read without waiting
+	this->polled = epoll_ctl(this->epollFd, EPOLL_CTL_ADD, this->fd, &event) == 0;
+	if (!this->polled && errno != EPERM) {
+		SDL_LogError(SDL_LOG_CATEGORY_INPUT, "Failed to watch %s: %s\n", path.c_str(), strerror(errno));
+		this->Close();
+		return false;
+	}
+	this->dropped = false;
+	this->hatX = 0;
+	this->hatY = 0;
+	this->hatValue = 0;
+	this->pending.clear();
+	this->pendingPos = 0;
+	this->replayStart = -1;
+	SDL_LogInfo(SDL_LOG_CATEGORY_INPUT, "Using %s %s for input\n", this->isStream ? "recorded stream" : "controller", path.c_str());
+	return true;
+}
+
+/*
+ * Open the configured device or the first controller found, probing
+ * /dev/input/eventN by ascending N, like SDL_JoystickOpen(0) does.
+ */
+bool SpeedOSKEvdev::Scan() {
+	if (!this->device.empty())
+		return this->Open(this->device);
+	DIR *dir = opendir("/dev/input");
+	if (!dir)
+		return false;
+	// readdir order is unspecified, sort to always pick the same controller
+	std::vector<int> numbers;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		char *end;
+		if (strncmp(entry->d_name, "event", 5) != 0 || !isdigit(entry->d_name[5]))
+			continue;
+		long number = strtol(entry->d_name + 5, &end, 10);
+		if (*end == '\0')
+			numbers.push_back(number);
+	}
+	closedir(dir);
+	std::sort(numbers.begin(), numbers.end());
+	for (int number : numbers) {
+		if (this->Open("/dev/input/event" + std::to_string(number)))
+			break;
+	}
+	return this->fd >= 0;
+}
+
+void SpeedOSKEvdev::Close() {
+	if (this->fd < 0)
+		return;
+	if (this->polled)
+		epoll_ctl(this->epollFd, EPOLL_CTL_DEL, this->fd, NULL);
+	this->polled = false;
+	close(this->fd);
+	this->fd = -1;
+}
+
+/*
+ * Number buttons and axes in the order SDL does for evdev devices,
+ * so the button and axis indexes match what SDL would report.
+ */
+void SpeedOSKEvdev::MapDevice() {
+	unsigned long keybit[NBITS(KEY_MAX)] = {0};
+	unsigned long absbit[NBITS(ABS_MAX)] = {0};
+	unsigned long keystate[NBITS(KEY_MAX)] = {0};
+	ioctl(this->fd, EVIOCGBIT(EV_KEY, sizeof(keybit)), keybit);
+	ioctl(this->fd, EVIOCGBIT(EV_ABS, sizeof(absbit)), absbit);
+	ioctl(this->fd, EVIOCGKEY(sizeof(keystate)), keystate);
+	int buttons = 0;
+	for (int code = 0; code < KEY_CNT; code++) {
+		this->buttonMap[code] = -1;
+		this->buttonState[code] = TEST_BIT(code, keystate);
+	}
+	for (int code = BTN_JOYSTICK; code < KEY_MAX; code++) {
+		if (TEST_BIT(code, keybit))
+			this->buttonMap[code] = buttons++;
+	}
+	for (int code = 0; code < BTN_JOYSTICK; code++) {
+		if (TEST_BIT(code, keybit))
+			this->buttonMap[code] = buttons++;
+	}
+	int axes = 0;
+	for (int code = 0; code < ABS_CNT; code++) {
+		this->axisMap[code] = -1;
+		memset(&this->absInfo[code], 0, sizeof(struct input_absinfo));
+		if (code >= ABS_HAT0X && code <= ABS_HAT3Y)
+			continue;
+		if (code < ABS_MAX && TEST_BIT(code, absbit) && ioctl(this->fd, EVIOCGABS(code), &this->absInfo[code]) == 0)
+			this->axisMap[code] = axes++;
+	}
+}
+
+/*
+ * A recording carries no device description, assume a standard xpad controller.
+ */
+void SpeedOSKEvdev::MapStream() {
+	static const int buttons[] = {BTN_SOUTH, BTN_EAST, BTN_NORTH, BTN_WEST, BTN_TL, BTN_TR,
+			BTN_SELECT, BTN_START, BTN_MODE, BTN_THUMBL, BTN_THUMBR};
+	static const int axes[] = {ABS_X, ABS_Y, ABS_Z, ABS_RX, ABS_RY, ABS_RZ};
+	for (int code = 0; code < KEY_CNT; code++) {
+		this->buttonMap[code] = -1;
+		this->buttonState[code] = false;
+	}
+	for (int code = 0; code < ABS_CNT; code++) {
+		this->axisMap[code] = -1;
+		memset(&this->absInfo[code], 0, sizeof(struct input_absinfo));
+	}
+	for (size_t i = 0; i < sizeof(buttons) / sizeof(buttons[0]); i++) {
+		this->buttonMap[buttons[i]] = i;
+	}
+	for (size_t i = 0; i < sizeof(axes) / sizeof(axes[0]); i++) {
+		this->axisMap[axes[i]] = i;
+		if (axes[i] == ABS_Z || axes[i] == ABS_RZ) {
+			this->absInfo[axes[i]].maximum = 255;
+		} else {
+			this->absInfo[axes[i]].minimum = -32768;
+			this->absInfo[axes[i]].maximum = 32767;
+		}
+	}
+}
+
+/*
+ * The controller is gone, report everything as released and centered
+ * like SDL does, otherwise held keys would stay down on the X side.
+ */
+void SpeedOSKEvdev::Release(std::vector<inputAction> &actions) {
+	long long timestamp = Now();
+	for (int code = 0; code < KEY_CNT; code++) {
+		if (this->buttonMap[code] < 0 || !this->buttonState[code])
+			continue;
+		this->buttonState[code] = false;
+		actions.push_back({INPUT_BUTTON, this->buttonMap[code], 0, timestamp});
+	}
+	if (this->hatValue != 0) {
+		this->hatX = 0;
+		this->hatY = 0;
+		this->hatValue = 0;
+		actions.push_back({INPUT_HAT, 0, 0, timestamp});
+	}
+	for (int code = 0; code < ABS_CNT; code++) {
+		if (this->axisMap[code] >= 0)
+			actions.push_back({INPUT_AXIS, this->axisMap[code], 0, timestamp});
+	}
+}
+
+/*
+ * The kernel dropped events, read the current state and report what changed.
+ */
+void SpeedOSKEvdev::Resync(long long timestamp, std::vector<inputAction> &actions) {
+	if (this->isStream)
+		return;
+	unsigned long keystate[NBITS(KEY_MAX)] = {0};
+	if (ioctl(this->fd, EVIOCGKEY(sizeof(keystate)), keystate) == 0) {
+		for (int code = 0; code < KEY_CNT; code++) {
+			bool down = TEST_BIT(code, keystate);
+			if (this->buttonMap[code] < 0 || this->buttonState[code] == down)
+				continue;
+			this->buttonState[code] = down;
+			actions.push_back({INPUT_BUTTON, this->buttonMap[code], down, timestamp});
+		}
+	}
+	struct input_absinfo info;
+	for (int code = 0; code < ABS_CNT; code++) {
+		bool hat = code == ABS_HAT0X || code == ABS_HAT0Y;
+		if ((this->axisMap[code] < 0 && !hat) || ioctl(this->fd, EVIOCGABS(code), &info) < 0)
+			continue;
+		struct input_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.input_event_sec = timestamp / 1000000;
+		ev.input_event_usec = timestamp % 1000000;
+		ev.type = EV_ABS;
+		ev.code = code;
+		ev.value = info.value;
+		this->Translate(ev, actions);
+	}
+}
+
+void SpeedOSKEvdev::Translate(const struct input_event &ev, std::vector<inputAction> &actions) {
+	long long timestamp = EventTime(ev);
+	if (ev.type == EV_SYN) {
+		if (ev.code == SYN_DROPPED) {
+			this->dropped = true;
+		} else if (ev.code == SYN_REPORT && this->dropped) {
+			this->dropped = false;
+			this->Resync(timestamp, actions);
+		}
+		return;
+	}
+	if (this->dropped)
+		return; // everything up to the next report is incomplete
+	if (ev.type == EV_KEY) {
+		// value 2 is the kernel autorepeat, SDL ignores it as well
+		if (ev.code >= KEY_CNT || this->buttonMap[ev.code] < 0 || ev.value == 2)
+			return;
+		this->buttonState[ev.code] = ev.value;
+		actions.push_back({INPUT_BUTTON, this->buttonMap[ev.code], ev.value, timestamp});
+	} else if (ev.type == EV_ABS) {
+		if (ev.code == ABS_HAT0X || ev.code == ABS_HAT0Y) {
+			if (ev.code == ABS_HAT0X)
+				this->hatX = ev.value;
+			else
+				this->hatY = ev.value;
+			// same bits as SDL_HAT_UP, SDL_HAT_RIGHT, SDL_HAT_DOWN and SDL_HAT_LEFT
+			int value = (this->hatY < 0 ? 1 : 0) | (this->hatX > 0 ? 2 : 0)
+					| (this->hatY > 0 ? 4 : 0) | (this->hatX < 0 ? 8 : 0);
+			if (value != this->hatValue) {
+				this->hatValue = value;
+				actions.push_back({INPUT_HAT, 0, value, timestamp});
+			}
+		} else if (ev.code < ABS_CNT && this->axisMap[ev.code] >= 0) {
+			actions.push_back({INPUT_AXIS, this->axisMap[ev.code], this->ScaleAxis(ev.code, ev.value), timestamp});
+		}
+	}
+}
+
+/*
+ * Scale a raw axis value to -32768..32767 like SDL does.
+ */
+int SpeedOSKEvdev::ScaleAxis(int code, int value) {
+	int min = this->absInfo[code].minimum;
+	int max = this->absInfo[code].maximum;
+	if (max <= min)
+		return value;
+	long long scaled = ((long long)value - min) * 65535 / ((long long)max - min) - 32768;
+	if (scaled < -32768)
+		scaled = -32768;
+	if (scaled > 32767)
+		scaled = 32767;
+	return scaled;
+}
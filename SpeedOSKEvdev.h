@@ -0,0 +1,88 @@
+/*
+ *   SpeedOSK is a vitrual keyboard intended to be used with a controller
+ *   Copyright (C) 2022 Constantin Wenger
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPEEDOSKEVDEV_H_
+#define SPEEDOSKEVDEV_H_
+#include <string>
+#include <vector>
+#include <linux/input.h>
+
+#define INPUT_BUTTON 0
+#define INPUT_AXIS 1
+#define INPUT_HAT 2
+
+/*
+ * One controller action in the same numbering SDL's joystick layer uses,
+ * SDL joystick events are turned into these as well.
+ * timestamp is the event time in microseconds, CLOCK_MONOTONIC for evdev.
+ */
+struct inputAction {
+	int type;
+	int index;
+	int value;
+	long long timestamp;
+};
+
+/*
+ * Reads a controller directly from /dev/input/event* with epoll.
+ * A recorded evdev stream (raw struct input_event records, e.g. from
+ * cat /dev/input/eventX > file) can be given instead of a device,
+ * it is replayed at its recorded pace with the mapping of a standard
+ * xpad controller.
+ */
+class SpeedOSKEvdev {
+public:
+	SpeedOSKEvdev(const std::string &device);
+	virtual ~SpeedOSKEvdev();
+	bool IsOpen();
+	void Watch(int fd);
+	bool Wait(int timeout, std::vector<inputAction> &actions);
+private:
+	std::string device;
+	int epollFd;
+	int fd;
+	bool isStream;
+	bool polled;
+	bool dropped;
+	int buttonMap[KEY_CNT];
+	int axisMap[ABS_CNT];
+	struct input_absinfo absInfo[ABS_CNT];
+	bool buttonState[KEY_CNT];
+	int hatX;
+	int hatY;
+	int hatValue;
+	std::vector<struct input_event> pending; // recorded events not handed out yet
+	size_t pendingPos;
+	long long replayStart; // when the replay started, -1 before the first event
+	long long replayBase; // recorded time of the first event
+	bool Open(const std::string &path);
+	bool Scan();
+	void Close();
+	void MapDevice();
+	void MapStream();
+	bool Replay(int timeout, std::vector<inputAction> &actions);
+	void WatchStream(bool readable);
+	static long long Now();
+	static long long EventTime(const struct input_event &ev);
+	void Release(std::vector<inputAction> &actions);
+	void Resync(long long timestamp, std::vector<inputAction> &actions);
+	void Translate(const struct input_event &ev, std::vector<inputAction> &actions);
+	int ScaleAxis(int code, int value);
+};
+
+#endif /* SPEEDOSKEVDEV_H_ */
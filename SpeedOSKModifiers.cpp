@@ -0,0 +1,143 @@
+/*
+ *   SpeedOSK is a vitrual keyboard intended to be used with a controller
+ *   Copyright (C) 2022 Constantin Wenger
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "SpeedOSKModifiers.h"
+
+SpeedOSKModifiers::SpeedOSKModifiers() {
+	this->sender = NULL;
+	this->keyCodeShift = 0;
+	this->keyCodeAlt = 0;
+	this->keyCodeCtrl = 0;
+	this->held = MOD_NONE;
+	this->latched = MOD_NONE;
+	this->locked = MOD_NONE;
+	this->idlePending = false;
+	this->idleAt = 0;
+}
+
+void SpeedOSKModifiers::Init(SpeedOSKKeySender *sender, int keyCodeShift, int keyCodeAlt, int keyCodeCtrl) {
+	this->sender = sender;
+	this->keyCodeShift = keyCodeShift;
+	this->keyCodeAlt = keyCodeAlt;
+	this->keyCodeCtrl = keyCodeCtrl;
+}
+
+/*
+ * Bring the held modifiers to what the next key needs,
+ * latched and locked modifiers are always part of that.
+ */
+void SpeedOSKModifiers::Apply(int required) {
+	this->idlePending = false;
+	this->Transition(required | this->latched | this->locked);
+}
+
+/*
+ * A key was released, latched modifiers are used up now.
+ * They are not released right away, the next key decides if they can stay,
+ * unless no key comes within MODIFIER_IDLE_TIMEOUT.
+ */
+void SpeedOSKModifiers::KeyReleased(Uint32 now) {
+	this->latched = MOD_NONE;
+	this->idlePending = this->held != this->locked;
+	this->idleAt = now + MODIFIER_IDLE_TIMEOUT;
+}
+
+/*
+ * Cycle the given modifiers like sticky keys do:
+ * off -> latched (next key only) -> locked -> off
+ */
+void SpeedOSKModifiers::Sticky(int mods) {
+	for (int mod = MOD_SHIFT; mod <= MOD_CTRL; mod <<= 1) {
+		if (!(mods & mod))
+			continue;
+		if (this->locked & mod) {
+			this->locked &= ~mod;
+		} else if (this->latched & mod) {
+			this->latched &= ~mod;
+			this->locked |= mod;
+		} else {
+			this->latched |= mod;
+		}
+	}
+	this->Idle();
+}
+
+/*
+ * Nothing is pressed that needs the held modifiers,
+ * drop everything that is not latched or locked.
+ */
+void SpeedOSKModifiers::Idle() {
+	this->idlePending = false;
+	this->Transition(this->latched | this->locked);
+}
+
+void SpeedOSKModifiers::ReleaseAll() {
+	this->latched = MOD_NONE;
+	this->locked = MOD_NONE;
+	this->Transition(MOD_NONE);
+}
+
+int SpeedOSKModifiers::Latched() {
+	return this->latched;
+}
+
+int SpeedOSKModifiers::Locked() {
+	return this->locked;
+}
+
+/*
+ * ms until held modifiers are dropped, -1 if nothing is waiting for that
+ */
+int SpeedOSKModifiers::Timeout(Uint32 now) {
+	if (!this->idlePending)
+		return -1;
+	if (SDL_TICKS_PASSED(now, this->idleAt))
+		return 0;
+	return this->idleAt - now;
+}
+
+/*
+ * Drop held modifiers when the idle timeout passed,
+ * returns true if events were sent and need a flush.
+ */
+bool SpeedOSKModifiers::Tick(Uint32 now) {
+	if (!this->idlePending || !SDL_TICKS_PASSED(now, this->idleAt))
+		return false;
+	this->Idle();
+	return true;
+}
+
+void SpeedOSKModifiers::Transition(int wanted) {
+	if (wanted == this->held)
+		return;
+	int press = wanted & ~this->held;
+	int release = this->held & ~wanted;
+	// release in reverse order of pressing: ctrl, alt, shift down and shift, alt, ctrl up
+	if (release & MOD_SHIFT)
+		this->sender->SendKey(this->keyCodeShift, false);
+	if (release & MOD_ALT)
+		this->sender->SendKey(this->keyCodeAlt, false);
+	if (release & MOD_CTRL)
+		this->sender->SendKey(this->keyCodeCtrl, false);
+	if (press & MOD_CTRL)
+		this->sender->SendKey(this->keyCodeCtrl, true);
+	if (press & MOD_ALT)
+		this->sender->SendKey(this->keyCodeAlt, true);
+	if (press & MOD_SHIFT)
+		this->sender->SendKey(this->keyCodeShift, true);
+	this->held = wanted;
+}
@@ -0,0 +1,75 @@
+/*
+ *   SpeedOSK is a vitrual keyboard intended to be used with a controller
+ *   Copyright (C) 2022 Constantin Wenger
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPEEDOSKMODIFIERS_H_
+#define SPEEDOSKMODIFIERS_H_
+#include <SDL2/SDL.h>
+
+#define MOD_NONE 0
+#define MOD_SHIFT 1
+#define MOD_ALT 2
+#define MOD_CTRL 4
+#define MOD_ALL (MOD_SHIFT | MOD_ALT | MOD_CTRL)
+
+/*
+ * Where key events end up, the board sends them to X with XTest.
+ */
+class SpeedOSKKeySender {
+public:
+	virtual ~SpeedOSKKeySender() {}
+	virtual void SendKey(int keyCode, bool down) = 0;
+};
+
+/*
+ * Keeps track of which modifiers are held on the X side and only sends
+ * the transitions needed to reach the set a key requires.
+ * Modifiers stay held between keys that need the same set, so typing
+ * several shifted letters only presses shift once.
+ * Latched modifiers apply to the next key only, locked ones until unlocked.
+ * Held modifiers are dropped once no key used them for MODIFIER_IDLE_TIMEOUT,
+ * so they do not turn later mouse clicks into ctrl+click and alike.
+ * The transitions go to the sender given to Init, no X involved here.
+ */
+class SpeedOSKModifiers {
+public:
+	SpeedOSKModifiers();
+	void Init(SpeedOSKKeySender *sender, int keyCodeShift, int keyCodeAlt, int keyCodeCtrl);
+	void Apply(int required);
+	void KeyReleased(Uint32 now);
+	void Sticky(int mods);
+	void Idle();
+	void ReleaseAll();
+	int Latched();
+	int Locked();
+	int Timeout(Uint32 now);
+	bool Tick(Uint32 now);
+private:
+	static const constexpr Uint32 MODIFIER_IDLE_TIMEOUT = 1000; // ms
+	SpeedOSKKeySender *sender;
+	int keyCodeShift;
+	int keyCodeAlt;
+	int keyCodeCtrl;
+	int held;
+	int latched;
+	int locked;
+	bool idlePending;
+	Uint32 idleAt;
+	void Transition(int wanted);
+};
+
+#endif /* SPEEDOSKMODIFIERS_H_ */
@@ -0,0 +1,95 @@
+/*
+ *   SpeedOSK is a vitrual keyboard intended to be used with a controller
+ *   Copyright (C) 2022 Constantin Wenger
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <sstream>
+#include "SpeedOSKRepeat.h"
+
+SpeedOSKRepeat::SpeedOSKRepeat() {
+	this->active = false;
+	this->keyCode = 0;
+	this->policy = REPEAT_NONE;
+	this->next = 0;
+	this->interval = REPEAT_INTERVAL;
+}
+
+void SpeedOSKRepeat::Press(int keyCode, int policy, Uint32 now) {
+	this->active = policy != REPEAT_NONE;
+	this->keyCode = keyCode;
+	this->policy = policy;
+	this->next = now + REPEAT_DELAY;
+	this->interval = REPEAT_INTERVAL;
+}
+
+void SpeedOSKRepeat::Release() {
+	this->active = false;
+}
+
+/*
+ * ms until the next repeat is due, -1 if no key is repeating
+ */
+int SpeedOSKRepeat::Timeout(Uint32 now) {
+	if (!this->active)
+		return -1;
+	if (SDL_TICKS_PASSED(now, this->next))
+		return 0;
+	return this->next - now;
+}
+
+/*
+ * Number of repeats due at now, the schedule moves on by that many.
+ */
+int SpeedOSKRepeat::Due(Uint32 now) {
+	int count = 0;
+	while (this->active && SDL_TICKS_PASSED(now, this->next) && count < REPEAT_BATCH_MAX) {
+		count++;
+		this->next += this->interval;
+		if (this->policy == REPEAT_ACCEL) {
+			this->interval = this->interval * 7 / 8;
+			if (this->interval < REPEAT_INTERVAL_MIN)
+				this->interval = REPEAT_INTERVAL_MIN;
+		}
+	}
+	// we were stalled for too long, do not try to catch up
+	if (this->active && SDL_TICKS_PASSED(now, this->next))
+		this->next = now + this->interval;
+	return count;
+}
+
+int SpeedOSKRepeat::KeyCode() {
+	return this->keyCode;
+}
+
+/*
+ * REPEAT_* policy of a keymap keycode line, the policy is the token after the code:
+ * "accel" => repeat and speed up, "repeat" => repeat at a fixed rate,
+ * nothing => do not repeat
+ */
+int SpeedOSKRepeat::ParsePolicy(const std::string &line) {
+	std::istringstream tokens(line);
+	std::string code, policy, rest;
+	tokens >> code >> policy >> rest;
+	if (!rest.empty())
+		SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Keymap not valid, unexpected \"%s\" after repeat policy in \"%s\"", rest.c_str(), line.c_str());
+	if (policy.empty())
+		return REPEAT_NONE;
+	if (policy == "accel")
+		return REPEAT_ACCEL;
+	if (policy == "repeat")
+		return REPEAT_FIXED;
+	SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Keymap not valid, unknown repeat policy \"%s\" in \"%s\"", policy.c_str(), line.c_str());
+	return REPEAT_NONE;
+}
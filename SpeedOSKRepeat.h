@@ -0,0 +1,54 @@
+/*
+ *   SpeedOSK is a vitrual keyboard intended to be used with a controller
+ *   Copyright (C) 2022 Constantin Wenger
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPEEDOSKREPEAT_H_
+#define SPEEDOSKREPEAT_H_
+#include <string>
+#include <SDL2/SDL.h>
+
+#define REPEAT_NONE 0
+#define REPEAT_FIXED 1
+#define REPEAT_ACCEL 2
+
+/*
+ * Repeats a held key on our side instead of relying on X autorepeat.
+ * The event loop asks for the time until the next repeat and calls Due
+ * when it wakes up, repeats that piled up meanwhile are reported together.
+ */
+class SpeedOSKRepeat {
+public:
+	SpeedOSKRepeat();
+	void Press(int keyCode, int policy, Uint32 now);
+	void Release();
+	int Timeout(Uint32 now);
+	int Due(Uint32 now);
+	int KeyCode();
+	static int ParsePolicy(const std::string &line);
+private:
+	static const constexpr Uint32 REPEAT_DELAY = 400; // ms before the first repeat
+	static const constexpr Uint32 REPEAT_INTERVAL = 80; // ms between repeats
+	static const constexpr Uint32 REPEAT_INTERVAL_MIN = 20; // fastest accelerated interval
+	static const constexpr int REPEAT_BATCH_MAX = 8; // more than that late is dropped
+	bool active;
+	int keyCode;
+	int policy;
+	Uint32 next;
+	Uint32 interval;
+};
+
+#endif /* SPEEDOSKREPEAT_H_ */
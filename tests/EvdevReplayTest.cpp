@@ -0,0 +1,128 @@
+/*
+ *   SpeedOSK is a vitrual keyboard intended to be used with a controller
+ *   Copyright (C) 2022 Constantin Wenger
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Replays a recorded evdev stream through SpeedOSKEvdev and checks
+ * the mapping, the pacing and the release at the end of the stream.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <unistd.h>
+#include "SpeedOSKEvdev.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+static long long Now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void Record(FILE *file, long long time, int type, int code, int value) {
+	struct input_event ev = {};
+	ev.input_event_sec = time / 1000000;
+	ev.input_event_usec = time % 1000000;
+	ev.type = type;
+	ev.code = code;
+	ev.value = value;
+	fwrite(&ev, sizeof(ev), 1, file);
+	ev.type = EV_SYN;
+	ev.code = SYN_REPORT;
+	ev.value = 0;
+	fwrite(&ev, sizeof(ev), 1, file);
+}
+
+struct received {
+	inputAction action;
+	long long at;
+};
+
+static const received *Find(const std::vector<received> &all, int type, int index, int value) {
+	for (const received &r : all) {
+		if (r.action.type == type && r.action.index == index && r.action.value == value)
+			return &r;
+	}
+	return NULL;
+}
+
+int main() {
+	char path[] = "/tmp/speedosk-replay-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	FILE *file = fdopen(fd, "wb");
+	// recorded times are arbitrary, only their distance matters
+	long long base = 5000000;
+	Record(file, base, EV_KEY, BTN_SOUTH, 1); // held until the end
+	Record(file, base, EV_ABS, ABS_HAT0Y, -1);
+	Record(file, base + 300000, EV_ABS, ABS_X, 32767);
+	Record(file, base + 300000, EV_ABS, ABS_Z, 255);
+	Record(file, base + 500000, EV_ABS, ABS_HAT0Y, 0);
+	fclose(file);
+
+	std::vector<received> all;
+	{
+		SpeedOSKEvdev evdev(path);
+		CHECK(evdev.IsOpen());
+		std::vector<inputAction> actions;
+		bool running = true;
+		long long start = Now();
+		while (running && Now() - start < 5000000) {
+			actions.clear();
+			running = evdev.Wait(-1, actions);
+			long long at = Now();
+			for (const inputAction &action : actions)
+				all.push_back({action, at});
+		}
+		CHECK(!running);
+	}
+	unlink(path);
+
+	const received *pressed = Find(all, INPUT_BUTTON, 0, 1);
+	const received *hatUp = Find(all, INPUT_HAT, 0, 1);
+	const received *stick = Find(all, INPUT_AXIS, 0, 32767);
+	const received *trigger = Find(all, INPUT_AXIS, 2, 32767);
+	const received *hatCentered = Find(all, INPUT_HAT, 0, 0);
+	const received *released = Find(all, INPUT_BUTTON, 0, 0);
+	CHECK(pressed && hatUp && stick && trigger && hatCentered && released);
+	if (pressed && stick && hatCentered && released) {
+		// replayed at the recorded pace, with some slack for a busy machine
+		CHECK(stick->at - pressed->at >= 290000);
+		CHECK(hatCentered->at - pressed->at >= 490000);
+		CHECK(hatCentered->at - pressed->at < 1500000);
+		// the button still held at the end of the stream gets released
+		CHECK(released->at >= hatCentered->at);
+		// timestamps are moved to replay time
+		CHECK(hatCentered->action.timestamp - pressed->action.timestamp >= 490000);
+	}
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,210 @@
+/*
+ *   SpeedOSK is a vitrual keyboard intended to be used with a controller
+ *   Copyright (C) 2022 Constantin Wenger
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Drives SpeedOSKModifiers the way the board does and checks
+ * which modifier transitions it sends.
+ */
+#include <cstdio>
+#include <string>
+#include "SpeedOSKModifiers.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+#define SHIFT 50
+#define ALT 64
+#define CTRL 37
+
+/*
+ * Records the sent events as "+50" for down and "-50" for up,
+ * Take hands them out and starts over.
+ */
+class RecordingSender : public SpeedOSKKeySender {
+public:
+	void SendKey(int keyCode, bool down) override {
+		if (!this->sent.empty())
+			this->sent += " ";
+		this->sent += (down ? "+" : "-") + std::to_string(keyCode);
+	}
+	std::string Take() {
+		std::string sent = this->sent;
+		this->sent.clear();
+		return sent;
+	}
+private:
+	std::string sent;
+};
+
+/*
+ * One key the way the board sends it: modifiers, then the key going down
+ * and up again, the key itself is not recorded.
+ */
+static void Key(SpeedOSKModifiers &modifiers, int required, Uint32 now) {
+	modifiers.Apply(required);
+	modifiers.KeyReleased(now);
+}
+
+static void TestElision() {
+	RecordingSender sender;
+	SpeedOSKModifiers modifiers;
+	modifiers.Init(&sender, SHIFT, ALT, CTRL);
+
+	Key(modifiers, MOD_SHIFT, 0);
+	CHECK(sender.Take() == "+50");
+	// more shifted keys keep shift held
+	Key(modifiers, MOD_SHIFT, 10);
+	Key(modifiers, MOD_SHIFT, 20);
+	CHECK(sender.Take() == "");
+	// only the difference is sent, ctrl goes down before shift
+	Key(modifiers, MOD_CTRL | MOD_SHIFT, 30);
+	CHECK(sender.Take() == "+37");
+	Key(modifiers, MOD_ALL, 40);
+	CHECK(sender.Take() == "+64");
+	// releases go shift, alt, ctrl and happen before presses
+	Key(modifiers, MOD_ALT, 50);
+	CHECK(sender.Take() == "-50 -37");
+	Key(modifiers, MOD_CTRL | MOD_SHIFT, 60);
+	CHECK(sender.Take() == "-64 +37 +50");
+	Key(modifiers, MOD_NONE, 70);
+	CHECK(sender.Take() == "-50 -37");
+	Key(modifiers, MOD_NONE, 80);
+	CHECK(sender.Take() == "");
+}
+
+static void TestSticky() {
+	RecordingSender sender;
+	SpeedOSKModifiers modifiers;
+	modifiers.Init(&sender, SHIFT, ALT, CTRL);
+
+	// latched: held for the next key only
+	modifiers.Sticky(MOD_SHIFT);
+	CHECK(sender.Take() == "+50");
+	CHECK(modifiers.Latched() == MOD_SHIFT);
+	CHECK(modifiers.Locked() == MOD_NONE);
+	Key(modifiers, MOD_NONE, 0);
+	CHECK(sender.Take() == "");
+	CHECK(modifiers.Latched() == MOD_NONE);
+	Key(modifiers, MOD_NONE, 10);
+	CHECK(sender.Take() == "-50");
+
+	// latched, then locked: stays for every key
+	modifiers.Sticky(MOD_SHIFT);
+	modifiers.Sticky(MOD_SHIFT);
+	CHECK(sender.Take() == "+50");
+	CHECK(modifiers.Latched() == MOD_NONE);
+	CHECK(modifiers.Locked() == MOD_SHIFT);
+	Key(modifiers, MOD_NONE, 20);
+	Key(modifiers, MOD_CTRL, 30);
+	CHECK(sender.Take() == "+37");
+	Key(modifiers, MOD_NONE, 40);
+	CHECK(sender.Take() == "-37");
+	CHECK(modifiers.Locked() == MOD_SHIFT);
+
+	// a third press turns it off again
+	modifiers.Sticky(MOD_SHIFT);
+	CHECK(sender.Take() == "-50");
+	CHECK(modifiers.Latched() == MOD_NONE);
+	CHECK(modifiers.Locked() == MOD_NONE);
+
+	// several modifiers on one sticky key cycle together
+	modifiers.Sticky(MOD_CTRL | MOD_ALT);
+	CHECK(sender.Take() == "+37 +64");
+	CHECK(modifiers.Latched() == (MOD_CTRL | MOD_ALT));
+
+	modifiers.Sticky(MOD_SHIFT);
+	modifiers.Sticky(MOD_SHIFT);
+	sender.Take();
+	modifiers.ReleaseAll();
+	CHECK(sender.Take() == "-50 -64 -37");
+	CHECK(modifiers.Latched() == MOD_NONE);
+	CHECK(modifiers.Locked() == MOD_NONE);
+}
+
+static void TestIdleTimeout() {
+	RecordingSender sender;
+	SpeedOSKModifiers modifiers;
+	modifiers.Init(&sender, SHIFT, ALT, CTRL);
+
+	CHECK(modifiers.Timeout(0) == -1);
+	Key(modifiers, MOD_SHIFT, 1000);
+	sender.Take();
+	CHECK(modifiers.Timeout(1000) == 1000);
+	CHECK(modifiers.Timeout(1600) == 400);
+	CHECK(!modifiers.Tick(1999));
+	CHECK(sender.Take() == "");
+	CHECK(modifiers.Tick(2000));
+	CHECK(sender.Take() == "-50");
+	CHECK(modifiers.Timeout(2000) == -1);
+	CHECK(!modifiers.Tick(5000));
+
+	// a key in time keeps them held and starts the wait over
+	Key(modifiers, MOD_SHIFT, 3000);
+	sender.Take();
+	modifiers.Apply(MOD_SHIFT);
+	CHECK(modifiers.Timeout(3900) == -1); // the key is still down
+	modifiers.KeyReleased(3900);
+	CHECK(modifiers.Timeout(3900) == 1000);
+	CHECK(!modifiers.Tick(4500));
+	CHECK(sender.Take() == "");
+
+	// locked modifiers are not dropped, so there is nothing to wait for
+	modifiers.Idle();
+	sender.Take();
+	modifiers.Sticky(MOD_CTRL);
+	modifiers.Sticky(MOD_CTRL);
+	sender.Take();
+	Key(modifiers, MOD_NONE, 6000);
+	CHECK(modifiers.Timeout(6000) == -1);
+	CHECK(!modifiers.Tick(8000));
+	CHECK(sender.Take() == "");
+
+	// locked plus something held for a key: only the held part is dropped
+	Key(modifiers, MOD_SHIFT, 9000);
+	CHECK(sender.Take() == "+50");
+	CHECK(modifiers.Tick(10000));
+	CHECK(sender.Take() == "-50");
+	CHECK(modifiers.Locked() == MOD_CTRL);
+
+	// the timer works across the Uint32 wrap of SDL_GetTicks
+	modifiers.ReleaseAll();
+	sender.Take();
+	Key(modifiers, MOD_ALT, 0xFFFFFF00);
+	sender.Take();
+	CHECK(modifiers.Timeout(0xFFFFFF00) == 1000);
+	CHECK(!modifiers.Tick(0x100));
+	CHECK(modifiers.Tick(0x2E8));
+	CHECK(sender.Take() == "-64");
+}
+
+int main() {
+	TestElision();
+	TestSticky();
+	TestIdleTimeout();
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
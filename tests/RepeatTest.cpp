@@ -0,0 +1,142 @@
+/*
+ *   SpeedOSK is a vitrual keyboard intended to be used with a controller
+ *   Copyright (C) 2022 Constantin Wenger
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs SpeedOSKRepeat on made up ticks and checks the repeat schedule,
+ * and the parsing of the keymap repeat policy.
+ */
+#include <cstdio>
+#include "SpeedOSKRepeat.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+static void TestNone() {
+	SpeedOSKRepeat repeat;
+	CHECK(repeat.Timeout(0) == -1);
+	repeat.Press(38, REPEAT_NONE, 1000);
+	CHECK(repeat.KeyCode() == 38);
+	CHECK(repeat.Timeout(1000) == -1);
+	CHECK(repeat.Due(5000) == 0);
+}
+
+static void TestFixed() {
+	SpeedOSKRepeat repeat;
+	repeat.Press(38, REPEAT_FIXED, 1000);
+	// 400 ms before the first repeat
+	CHECK(repeat.Timeout(1000) == 400);
+	CHECK(repeat.Timeout(1300) == 100);
+	CHECK(repeat.Due(1399) == 0);
+	CHECK(repeat.Timeout(1400) == 0);
+	CHECK(repeat.Due(1400) == 1);
+	// then every 80 ms, it does not speed up
+	for (Uint32 now = 1480; now < 3000; now += 80) {
+		CHECK(repeat.Timeout(now - 80) == 80);
+		CHECK(repeat.Due(now) == 1);
+	}
+	// waking up late reports what piled up, the schedule stays on the grid
+	Uint32 next = 1400 + 80 * 20; // first one after the loop
+	CHECK(repeat.Due(next + 80 * 2 + 10) == 3);
+	CHECK(repeat.Timeout(next + 80 * 2 + 10) == 70);
+
+	repeat.Release();
+	CHECK(repeat.Timeout(next + 80 * 3) == -1);
+	CHECK(repeat.Due(next + 80 * 10) == 0);
+
+	// pressing again starts with the full delay
+	repeat.Press(39, REPEAT_FIXED, 10000);
+	CHECK(repeat.KeyCode() == 39);
+	CHECK(repeat.Timeout(10000) == 400);
+}
+
+static void TestAccel() {
+	SpeedOSKRepeat repeat;
+	repeat.Press(38, REPEAT_ACCEL, 0);
+	CHECK(repeat.Timeout(0) == 400);
+	Uint32 now = 400;
+	CHECK(repeat.Due(now) == 1);
+	// every interval is 7/8 of the one before, down to 20 ms
+	int expected[] = {80, 70, 61, 53, 46, 40, 35, 30, 26, 22, 20, 20, 20};
+	for (int interval : expected) {
+		CHECK(repeat.Timeout(now) == interval);
+		now += interval;
+		CHECK(repeat.Due(now) == 1);
+	}
+	// a new press starts slow again
+	repeat.Press(38, REPEAT_ACCEL, now);
+	now += 400;
+	CHECK(repeat.Due(now) == 1);
+	CHECK(repeat.Timeout(now) == 80);
+}
+
+static void TestStall() {
+	SpeedOSKRepeat repeat;
+	repeat.Press(38, REPEAT_FIXED, 0);
+	// two seconds late would be 21 repeats, only 8 are sent
+	CHECK(repeat.Due(2400) == 8);
+	// and the rest is skipped, the next one is a full interval from now
+	CHECK(repeat.Timeout(2400) == 80);
+	CHECK(repeat.Due(2479) == 0);
+	CHECK(repeat.Due(2480) == 1);
+
+	// exactly 8 due is not a stall, the schedule is kept
+	repeat.Press(38, REPEAT_FIXED, 0);
+	CHECK(repeat.Due(400 + 80 * 7) == 8);
+	CHECK(repeat.Timeout(400 + 80 * 7) == 80);
+
+	// the same across the Uint32 wrap of SDL_GetTicks
+	repeat.Press(38, REPEAT_FIXED, 0xFFFFFF00);
+	CHECK(repeat.Timeout(0xFFFFFF00) == 400);
+	CHECK(repeat.Due(0xFFFFFF00 + 399) == 0);
+	CHECK(repeat.Due(0xFFFFFF00 + 400) == 1);
+}
+
+static void TestParsePolicy() {
+	CHECK(SpeedOSKRepeat::ParsePolicy("38") == REPEAT_NONE);
+	CHECK(SpeedOSKRepeat::ParsePolicy("38 repeat") == REPEAT_FIXED);
+	CHECK(SpeedOSKRepeat::ParsePolicy("38 accel") == REPEAT_ACCEL);
+	CHECK(SpeedOSKRepeat::ParsePolicy("1038\taccel") == REPEAT_ACCEL);
+	CHECK(SpeedOSKRepeat::ParsePolicy("38 accel ") == REPEAT_ACCEL);
+	// only the exact token counts
+	CHECK(SpeedOSKRepeat::ParsePolicy("38 repeated") == REPEAT_NONE);
+	CHECK(SpeedOSKRepeat::ParsePolicy("38 accelerate") == REPEAT_NONE);
+	CHECK(SpeedOSKRepeat::ParsePolicy("38 Accel") == REPEAT_NONE);
+	CHECK(SpeedOSKRepeat::ParsePolicy("38 norepeat") == REPEAT_NONE);
+	// extra tokens are reported, the policy before them still applies
+	CHECK(SpeedOSKRepeat::ParsePolicy("38 repeat accel") == REPEAT_FIXED);
+	CHECK(SpeedOSKRepeat::ParsePolicy("38 foo bar") == REPEAT_NONE);
+}
+
+int main() {
+	TestNone();
+	TestFixed();
+	TestAccel();
+	TestStall();
+	TestParsePolicy();
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}